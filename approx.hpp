@@ -0,0 +1,187 @@
+#pragma once
+
+#include "sketch.hpp"
+#include "snapshot.hpp"
+#include "worker.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <functional>
+#include <set>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+const size_t RECALL_SAMPLE = 1000;
+
+// estimated similarity of a pair of users (i, j)
+using estimate_t = std::tuple<float, size_t, size_t>;
+using estimates_t = std::vector<estimate_t>;
+// pair of users (i, j) with a random priority, the ones with the lowest
+// priorities are a uniform sample of all the pairs
+using sampled_t = std::tuple<uint64_t, size_t, size_t>;
+
+// The candidates, and a sample of all the pairs, of a part of the ranking.
+struct tier_t {
+  estimates_t candidates;
+  std::vector<sampled_t> sample;
+  size_t num_pairs = 0;
+};
+
+// Push the value in the heap ordered by `cmp`, keeping only the first `limit`
+// values in that order.
+template <typename T, typename Compare>
+void push_bounded(std::vector<T> &heap, const T &value, size_t limit,
+                  Compare cmp) {
+  if (heap.size() == limit && !cmp(value, heap.front()))
+    return;
+  heap.push_back(value);
+  std::push_heap(heap.begin(), heap.end(), cmp);
+  if (heap.size() > limit) {
+    std::pop_heap(heap.begin(), heap.end(), cmp);
+    heap.pop_back();
+  }
+}
+
+void push_estimate(estimates_t &heap, const estimate_t &est, size_t limit) {
+  push_bounded(heap, est, limit, std::greater<estimate_t>());
+}
+
+void push_sample(std::vector<sampled_t> &heap, const sampled_t &pair) {
+  push_bounded(heap, pair, RECALL_SAMPLE, std::less<sampled_t>());
+}
+
+// Rescore exactly the candidates of a tier and add the results to `partial`.
+// The sampled pairs that are not candidates are rescored too, to estimate how
+// many of the pairs left out would have entered the best results.
+void rescore_tier(const file_list_t &files, const block_list_t &blocks,
+                  const std::string &name, const tier_t &tier,
+                  partial_t &partial) {
+  std::set<std::pair<size_t, size_t>> chosen;
+  std::vector<std::pair<size_t, size_t>> pairs;
+  for (const auto &[est, i, j] : tier.candidates) {
+    chosen.emplace(i, j);
+    pairs.emplace_back(i, j);
+  }
+  for (const auto &[priority, i, j] : tier.sample) {
+    if (!chosen.count({i, j}))
+      pairs.emplace_back(i, j);
+  }
+
+  std::vector<info_t> exact(pairs.size());
+  std::atomic<size_t> pos(0);
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < std::thread::hardware_concurrency(); t++) {
+    threads.emplace_back([&files, &blocks, &pairs, &exact, &pos]() {
+      workspace_t ws;
+      for (size_t k = pos++; k < pairs.size(); k = pos++) {
+        exact[k] =
+            best_match(files, blocks, pairs[k].first, pairs[k].second, ws);
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  for (size_t k = 0; k < tier.candidates.size(); k++) {
+    if (std::get<0>(exact[k]) >= 0)
+      partial.insert(exact[k]);
+  }
+
+  // each sampled pair stands for `scale` pairs left out: merging them with the
+  // results found gives an estimate of the best results of all the pairs, and
+  // of how many of them were found
+  size_t sampled = pairs.size() - tier.candidates.size();
+  size_t others = tier.num_pairs - tier.candidates.size();
+  double scale = sampled ? 1.0 * others / sampled : 0;
+  std::vector<std::pair<float, bool>> merged;
+  for (const auto &[perc, a, b] : partial)
+    merged.emplace_back(perc, true);
+  for (size_t k = tier.candidates.size(); k < pairs.size(); k++) {
+    if (std::get<0>(exact[k]) >= 0)
+      merged.emplace_back(std::get<0>(exact[k]), false);
+  }
+  std::sort(merged.begin(), merged.end(), std::greater<>());
+  double found = 0, total = 0;
+  size_t missed = 0;
+  for (const auto &[perc, is_found] : merged) {
+    if (total >= MAX_RESULTS)
+      break;
+    double weight = std::min(is_found ? 1 : scale, MAX_RESULTS - total);
+    found += is_found ? weight : 0;
+    total += weight;
+    missed += !is_found;
+  }
+  double recall = total > 0 ? 100.0 * found / total : 100.0;
+
+  fprintf(stderr,
+          "%s: %ld candidates out of %ld pairs | %ld of %ld sampled pairs out "
+          "of the candidates are in the estimated best %ld | estimated recall "
+          "%.1f%%\n",
+          name.c_str(), tier.candidates.size(), tier.num_pairs, missed,
+          sampled, MAX_RESULTS, recall);
+}
+
+// Rank every pair of users by the similarity estimated from the sketches of
+// their files, and compute smart_dist only on the best `candidates` pairs of
+// each tier. The recall is estimated on a random sample of the other pairs.
+void approx_run(const file_list_t &files, const block_list_t &blocks,
+                size_t cutoff, size_t resume_index, size_t candidates,
+                partial_t &partial_hi, partial_t &partial_lo) {
+  // sketches[u][k] is the sketch of files[u][k]
+  std::vector<std::vector<file_sketch_t>> sketches(files.size());
+  for (size_t u = 0; u < files.size(); u++)
+    for (const auto &[file, perc] : files[u])
+      sketches[u].push_back(compute_sketch(file));
+
+  std::cerr << "Estimating the similarity of all the pairs..." << std::endl;
+  size_t nthreads = std::thread::hardware_concurrency();
+  std::vector<std::pair<tier_t, tier_t>> tiers(nthreads);
+  std::atomic<size_t> pos(resume_index);
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < nthreads; t++) {
+    threads.emplace_back([&files, &sketches, &tiers, &pos, cutoff, candidates,
+                          t]() {
+      auto &[hi, lo] = tiers[t];
+      // like in worker, the pairs before `resume_index` are already done
+      for (size_t j = pos++; j < files.size(); j = pos++) {
+        for (size_t i = 0; i < j; i++) {
+          tier_t &tier = i < cutoff ? hi : lo;
+          tier.num_pairs++;
+          push_sample(tier.sample, {mix_hash(i * files.size() + j), i, j});
+          float best = 0;
+          for (size_t a = 0; a < files[i].size(); a++)
+            for (size_t b = 0; b < files[j].size(); b++)
+              best = std::max(best, sketch_dist(files[i][a].first,
+                                                sketches[i][a],
+                                                files[j][b].first,
+                                                sketches[j][b]));
+          if (best > 0)
+            push_estimate(tier.candidates, {best, i, j}, candidates);
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  auto merge = [candidates](tier_t &tier, const tier_t &part) {
+    tier.num_pairs += part.num_pairs;
+    for (auto &est : part.candidates)
+      push_estimate(tier.candidates, est, candidates);
+    for (auto &pair : part.sample)
+      push_sample(tier.sample, pair);
+  };
+  tier_t hi, lo;
+  for (auto &[h, l] : tiers) {
+    merge(hi, h);
+    merge(lo, l);
+  }
+
+  std::cerr << "Rescoring the best candidates..." << std::endl;
+  rescore_tier(files, blocks, "HIGH", hi, partial_hi);
+  rescore_tier(files, blocks, "LOW", lo, partial_lo);
+}
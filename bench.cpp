@@ -0,0 +1,130 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <new>
+
+#include "file.hpp"
+#include "smart_dist.hpp"
+
+std::atomic<size_t> allocations(0);
+
+void *operator new(size_t size) {
+  allocations++;
+  if (void *ptr = std::malloc(size))
+    return ptr;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { std::free(ptr); }
+
+double elapsed(std::chrono::high_resolution_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::high_resolution_clock::now() - start)
+             .count() /
+         1.0e9;
+}
+
+void report(const char *name, double time, size_t pairs, size_t allocs) {
+  printf("%-22s %8.3fs %10.0f pairs/s %10.2f allocations/pair\n", name, time,
+         pairs / time, 1.0 * allocs / pairs);
+}
+
+// Compare every pair of files in a folder, one pair at a time and in batches
+// with a single workspace, measuring the time and the heap allocations. The
+// batches are the files in the same directory, like the files of a user.
+int main(int argc, char **argv) {
+  if (argc != 2 && argc != 3) {
+    std::cerr << "Usage: " << argv[0] << " folder [max_files]" << std::endl;
+    return 1;
+  }
+  size_t max_files = argc == 3 ? std::atoi(argv[2]) : 100;
+
+  std::vector<std::string> paths;
+  for (const auto &entry :
+       std::filesystem::recursive_directory_iterator(argv[1])) {
+    if (entry.is_regular_file() && entry.file_size() <= 32 * 1024)
+      paths.push_back(entry.path().string());
+  }
+  std::sort(paths.begin(), paths.end());
+  if (paths.size() > max_files)
+    paths.resize(max_files);
+
+  std::map<std::string, user_files_t> blocks;
+  for (const auto &path : paths) {
+    auto dir = std::filesystem::path(path).parent_path().string();
+    blocks[dir].emplace_back(file_t(path), 0);
+    // two files without tokens have a NaN score, which is not equal to itself
+    if (blocks[dir].back().first.content.empty())
+      blocks[dir].pop_back();
+  }
+  std::vector<query_profile_t> profiles;
+  for (const auto &[dir, block] : blocks) {
+    for (const auto &[file, perc] : block) {
+      profiles.emplace_back(file);
+    }
+  }
+  size_t num_pairs = profiles.size() * profiles.size();
+  printf("%ld files in %ld folders, %ld pairs\n", profiles.size(),
+         blocks.size(), num_pairs);
+
+  std::vector<float> expected;
+  expected.reserve(num_pairs);
+  size_t allocs = allocations;
+  auto start = std::chrono::high_resolution_clock::now();
+  for (const auto &query : profiles) {
+    for (const auto &[dir, block] : blocks) {
+      for (const auto &[file, perc] : block) {
+        expected.push_back(smart_dist(file, *query.file));
+      }
+    }
+  }
+  report("pair at a time", elapsed(start), num_pairs, allocations - allocs);
+
+  std::vector<block_t> prepared(blocks.size());
+  auto prepared_it = prepared.begin();
+  for (const auto &[dir, block] : blocks) {
+    prepare_block(block, *prepared_it++);
+  }
+
+  workspace_t ws;
+  std::vector<float> scores;
+  scores.reserve(num_pairs);
+  double times[2];
+  for (int pass = 0; pass < 3; pass++) {
+    const char *names[] = {"batched (warm-up)", "batched, no skipping",
+                           "batched"};
+    // without skipping all the rows of DP are computed, so the warm-up
+    // allocates the memory needed by the other passes too
+    ws.skip_shared = pass == 2;
+    scores.clear();
+    allocs = allocations;
+    start = std::chrono::high_resolution_clock::now();
+    for (const auto &query : profiles) {
+      for (const auto &block : prepared) {
+        smart_dist_many(query, block, ws, scores);
+      }
+    }
+    double time = elapsed(start);
+    size_t pass_allocs = allocations - allocs;
+    report(names[pass], time, num_pairs, pass_allocs);
+    if (pass > 0)
+      times[pass - 1] = time;
+    if (scores != expected) {
+      std::cerr << "The batched scores are different!" << std::endl;
+      return 1;
+    }
+    // after the warm-up the workspace is large enough for every pair
+    if (pass > 0 && pass_allocs != 0) {
+      std::cerr << "The batched comparisons allocated memory!" << std::endl;
+      return 1;
+    }
+  }
+  printf("speedup of skipping the shared tokens: %.2fx\n",
+         times[0] / times[1]);
+}
@@ -1,9 +1,11 @@
 #pragma once
 
 #include <cassert>
+#include <cstdint>
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -14,6 +16,27 @@ using key_t = int;
 std::map<std::string, key_t> mapping = {{"", 0}};
 std::map<key_t, std::string> rev_mapping = {{0, ""}};
 
+// Files are identified by an id in the results, the paths are kept only once
+// here. They are read and written by many threads, so always use get_file_id
+// and get_file_path.
+using file_id_t = uint32_t;
+std::mutex file_ids_mutex;
+std::vector<std::string> file_paths;
+std::map<std::string, file_id_t> file_ids;
+
+file_id_t get_file_id(const std::string &path) {
+  std::lock_guard<std::mutex> lock(file_ids_mutex);
+  auto [it, inserted] = file_ids.emplace(path, file_paths.size());
+  if (inserted)
+    file_paths.push_back(path);
+  return it->second;
+}
+
+std::string get_file_path(file_id_t id) {
+  std::lock_guard<std::mutex> lock(file_ids_mutex);
+  return file_paths[id];
+}
+
 static const std::string specials = "!\"#$%&'()*+,-./:;<=>?@[\\]^`{|}~";
 
 constexpr const char *diff_color(diff_t d) {
@@ -42,11 +65,13 @@ struct file_t {
 
   std::string group;
   std::string path;
+  file_id_t id;
   content_t content;
   std::vector<std::string> spaces;
 
   file_t(std::string file) {
     path = file;
+    id = get_file_id(path);
     std::ifstream in(file);
     std::string str((std::istreambuf_iterator<char>(in)),
                     std::istreambuf_iterator<char>());
@@ -125,3 +150,6 @@ struct file_t {
       out << spaces.back() << std::endl;
   }
 };
+
+// files of a user, with their similarity to the most similar template
+using user_files_t = std::vector<std::pair<file_t, float>>;
@@ -1,4 +1,6 @@
+#include "approx.hpp"
 #include "file.hpp"
+#include "pipeline.hpp"
 #include "root_subs.hpp"
 #include "smart_dist.hpp"
 #include "snapshot.hpp"
@@ -9,6 +11,7 @@
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <queue>
 #include <set>
 #include <string>
@@ -17,6 +20,10 @@
 #include <vector>
 
 const float TEMPLATE_PERC_THRESHOLD = 95.0;
+// number of users read but not yet compared with the templates
+const size_t LOAD_QUEUE_SIZE = 64;
+// seconds between two updates of the provisional results
+const double PUBLISH_INTERVAL = 60;
 
 std::vector<std::string> read_ranking(std::string ranking_path) {
   std::vector<std::string> ranking;
@@ -30,7 +37,7 @@ std::vector<std::string> read_ranking(std::string ranking_path) {
 
 bool ensure_snap_same_task(const partial_t &partial, std::string soldir) {
   if (!partial.empty()) {
-    auto &[perc, f1, f2] = *partial.begin();
+    std::string f1 = get_file_path(std::get<1>(*partial.begin()));
     if (f1.rfind(soldir, 0) != 0) {
       std::cerr << "\033[41;37;1mWARNING!\033[0m The snapshot is using a "
                    "different directory with the solutions!"
@@ -72,90 +79,114 @@ std::tuple<int, int, int> compute_eta(T start, size_t progress, size_t total) {
   return {h, m, s};
 }
 
-file_list_t read_files(std::string soldir,
-                       const std::vector<std::string> &ranking,
-                       const std::vector<file_t> &templates,
-                       size_t resume_index) {
-  file_list_t files(ranking.size());
-  size_t num_files = 0;
-  for (const auto &entry : std::filesystem::directory_iterator(soldir)) {
-    std::string group_name = entry.path().filename();
-    for (size_t u = resume_index; u < ranking.size(); u++) {
-      std::string dir = soldir + "/" + group_name + "/" + ranking[u];
-      if (!std::filesystem::exists(dir)) {
-        continue;
-      }
-      for (const auto &path : std::filesystem::directory_iterator(dir)) {
-        const size_t THRESHOLD = 32 * 1024;
-        auto size = std::filesystem::file_size(path.path());
-        if (size <= THRESHOLD) {
-          file_t file(path.path());
-          file.group = group_name;
-          files[u].emplace_back(file, 0);
-          num_files++;
-        } else {
-          std::cerr << "Ignoring too big file " << path.path().string() << ": "
-                    << size << " > " << THRESHOLD << std::endl;
+// Start the threads that read the files of every user and compare them with
+// the templates. The files are read by a single thread, in ranking order,
+// since the tokenizer updates the global mapping. Each user is marked in
+// `ready` as soon as its files are compared with the templates and its block
+// is prepared, so that the workers can start without waiting for the others.
+std::vector<std::thread>
+read_files(std::string soldir, const std::vector<std::string> &ranking,
+           const profiles_t &templates, file_list_t &files,
+           block_list_t &blocks, ready_users_t &ready,
+           std::atomic<size_t> &num_files, std::atomic<size_t> &files_ignored) {
+  using loaded_user_t = std::pair<size_t, user_files_t>;
+  auto queue =
+      std::make_shared<bounded_queue_t<loaded_user_t>>(LOAD_QUEUE_SIZE);
+  std::vector<std::thread> threads;
+
+  threads.emplace_back([soldir, &ranking, &num_files, queue]() {
+    std::vector<std::string> groups;
+    for (const auto &entry : std::filesystem::directory_iterator(soldir)) {
+      groups.push_back(entry.path().filename());
+    }
+    for (size_t u = 0; u < ranking.size(); u++) {
+      loaded_user_t user = {u, {}};
+      for (const auto &group_name : groups) {
+        std::string dir = soldir + "/" + group_name + "/" + ranking[u];
+        if (!std::filesystem::exists(dir)) {
+          continue;
+        }
+        for (const auto &path : std::filesystem::directory_iterator(dir)) {
+          const size_t THRESHOLD = 32 * 1024;
+          auto size = std::filesystem::file_size(path.path());
+          if (size <= THRESHOLD) {
+            file_t file(path.path());
+            file.group = group_name;
+            user.second.emplace_back(file, 0);
+            num_files++;
+          } else {
+            std::cerr << "Ignoring too big file " << path.path().string()
+                      << ": " << size << " > " << THRESHOLD << std::endl;
+          }
         }
       }
+      queue->push(std::move(user));
     }
-  }
+    queue->close();
+  });
 
-  std::cerr << "Comparing files with templates..." << std::endl;
-  std::atomic<size_t> pos(resume_index), files_done(0), files_ignored(0);
   size_t nthreads = std::thread::hardware_concurrency();
-  std::vector<std::thread> threads;
-
   for (size_t t = 0; t < nthreads; t++) {
-    threads.emplace_back(
-        [&files, &ranking, &templates, &pos, &files_done, &files_ignored]() {
-          for (size_t u = pos++; u < ranking.size(); u = pos++) {
-            std::vector<size_t> to_remove;
-            for (size_t i = 0; i < files[u].size(); i++) {
-              auto &[file, perc] = files[u][i];
-              for (const file_t &templ : templates) {
-                perc = std::max(perc, smart_dist(file, templ, 0.0));
-              }
-              if (perc > TEMPLATE_PERC_THRESHOLD) {
-                to_remove.push_back(i);
-              }
-            }
-            files_done += files[u].size();
-            for (ssize_t i = to_remove.size() - 1; i >= 0; i--) {
-              std::swap(files[u][to_remove[i]], files[u].back());
-              files[u].pop_back();
-            }
-            files_ignored += to_remove.size();
+    threads.emplace_back([&files, &blocks, &templates, &ready, &files_ignored,
+                          queue]() {
+      loaded_user_t user;
+      workspace_t ws;
+      while (queue->pop(user)) {
+        auto &[u, user_files] = user;
+        prepare_block(user_files, ws.block);
+        for (const query_profile_t &templ : templates) {
+          auto &scores = ws.scores;
+          scores.clear();
+          smart_dist_many(templ, ws.block, ws, scores, 0.0);
+          for (size_t i = 0; i < user_files.size(); i++) {
+            auto &perc = user_files[i].second;
+            perc = std::max(perc, scores[i]);
           }
-        });
+        }
+        std::vector<size_t> to_remove;
+        for (size_t i = 0; i < user_files.size(); i++) {
+          if (user_files[i].second > TEMPLATE_PERC_THRESHOLD) {
+            to_remove.push_back(i);
+          }
+        }
+        for (ssize_t i = to_remove.size() - 1; i >= 0; i--) {
+          std::swap(user_files[to_remove[i]], user_files.back());
+          user_files.pop_back();
+        }
+        files_ignored += to_remove.size();
+        files[u] = std::move(user_files);
+        prepare_block(files[u], blocks[u]);
+        ready.mark(u);
+      }
+    });
   }
-  auto start = std::chrono::high_resolution_clock::now();
-  while (files_done < num_files) {
-    if (files_done) {
-      auto [h, m, s] = compute_eta(start, files_done.load(), num_files);
-      fprintf(stderr,
-              "\033[J files %6ld / %6ld (%6.2f%%) | user %4ld / %4ld | ETA "
-              "%4d:%02d:%02d\r",
-              files_done.load(), num_files,
-              100.0 * files_done.load() / num_files, pos.load(), ranking.size(),
-              h, m, s);
+  return threads;
+}
+
+// Merge the snapshots of the workers into `provisional`, in the same format of
+// `total`, so that the matches can be reviewed while the run continues.
+void publish_provisional(const std::string &target_path, partial_t hi,
+                         partial_t lo) {
+  size_t index = std::numeric_limits<size_t>::max();
+  for (auto &f : std::filesystem::directory_iterator(target_path)) {
+    auto name = f.path().filename().string();
+    if (name.rfind("snap", 0) == 0 &&
+        name.find("_temp", name.size() - 5) == std::string::npos) {
+      read_snap(f.path().string(), false, index, hi, lo);
     }
-    using namespace std::chrono_literals;
-    std::this_thread::sleep_for(1s);
   }
-  for (auto &thread : threads) {
-    thread.join();
-  }
-  fprintf(stderr, "\033[J files %6ld / %6ld (%6.2f%%) | user %4ld / %4ld\n",
-          num_files, num_files, 100.0, ranking.size(), ranking.size());
-  std::cerr << "Ignored " << files_ignored << " files" << std::endl;
-  return files;
+  if (index == std::numeric_limits<size_t>::max())
+    index = 0;
+  prune_extra_results(hi);
+  prune_extra_results(lo);
+  save_snap(index, hi, lo, target_path + "/provisional");
 }
 
 int main(int argc, char **argv) {
-  if (argc != 6) {
+  if (argc != 6 && argc != 7) {
     std::cerr << "Usage: " << argv[0]
-              << " soldir templatedir ranking.txt cutoff target" << std::endl;
+              << " soldir templatedir ranking.txt cutoff target [candidates]"
+              << std::endl;
     return 1;
   }
 
@@ -164,6 +195,9 @@ int main(int argc, char **argv) {
   std::string ranking_path = argv[3];
   int cutoff = std::atoi(argv[4]);
   std::string target_path = argv[5];
+  // when set, only the best `candidates` pairs by estimated similarity are
+  // compared exactly
+  size_t candidates = argc == 7 ? std::atoi(argv[6]) : 0;
 
   std::filesystem::create_directories(target_path);
 
@@ -206,48 +240,94 @@ int main(int argc, char **argv) {
 
   std::cerr << "Reading template files..." << std::endl;
   std::vector<file_t> templates = read_templates(templatedir);
+  profiles_t template_profiles(templates.begin(), templates.end());
 
   std::cerr << "Reading solution files..." << std::endl;
-  file_list_t files = read_files(soldir, ranking, templates, resume_index);
+  file_list_t files(ranking.size());
+  block_list_t blocks(ranking.size());
+  ready_users_t ready(ranking.size());
+  std::atomic<size_t> num_files(0), files_ignored(0);
+  std::vector<std::thread> loaders = read_files(
+      soldir, ranking, template_profiles, files, blocks, ready, num_files,
+      files_ignored);
 
-  // files are read, since we don't want to print them this mapping is useless
-  mapping.clear();
+  auto finish_loading = [&]() {
+    for (auto &thread : loaders) {
+      thread.join();
+    }
+    // files are read, since we don't want to print them this mapping is
+    // useless
+    mapping.clear();
+    std::cerr << "\033[JRead " << num_files << " files, ignored "
+              << files_ignored << " files" << std::endl;
+  };
+
+  if (candidates > 0) {
+    finish_loading();
+    // the approximate results are not saved in the partial snapshot, so that a
+    // later exact run does not skip any pair
+    approx_run(files, blocks, cutoff, resume_index, candidates, partial_hi,
+               partial_lo);
+    prune_extra_results(partial_hi);
+    prune_extra_results(partial_lo);
+    save_snap(files.size(), partial_hi, partial_lo, target_path + "/total");
+    save_binary(files.size(), partial_hi, partial_lo,
+                target_path + "/total.bin");
+    return 0;
+  }
 
   std::cerr << "Starting from " << resume_index << std::endl;
 
   int nthreads = std::thread::hardware_concurrency();
   std::cerr << "Using " << nthreads << " threads" << std::endl;
 
-  std::vector<std::pair<queue_t, queue_t>> results(nthreads);
+  shared_topk_t top_hi(nthreads), top_lo(nthreads);
+  // the results of the previous runs are already known
+  if (partial_hi.size() == MAX_RESULTS)
+    top_hi.raise_floor(std::get<0>(*partial_hi.rbegin()));
+  if (partial_lo.size() == MAX_RESULTS)
+    top_lo.raise_floor(std::get<0>(*partial_lo.rbegin()));
   std::vector<std::thread> threads;
   std::vector<size_t> current_index(nthreads);
   std::atomic<size_t> progress(0), global_pos(resume_index);
   auto start = std::chrono::high_resolution_clock::now();
 
-  // spawn all the workers
+  // spawn all the workers, they start as soon as the first users are ready
   for (int i = 0; i < nthreads; i++) {
-    threads.emplace_back(worker, &files, cutoff, &global_pos, i, &results[i],
-                         &progress, &current_index[i], target_path);
+    threads.emplace_back(worker, &files, &blocks, cutoff, &global_pos, i,
+                         &top_hi, &top_lo, &progress, &current_index[i],
+                         &ready, target_path);
   }
 
-  // meanwhile compute the total number of pairs to process
+  // the total number of pairs to process is known only when all the files are
+  // read
+  bool loaded = false;
   size_t num_pairs = 0;
-  size_t tot = 0;
-  for (size_t i = resume_index; i < files.size(); i++) {
-    tot += files[i].size();
-  }
-  for (size_t i = resume_index; i < files.size(); i++) {
-    num_pairs += files[i].size() * (tot - files[i].size());
-  }
-  num_pairs /= 2;
-
-  printf(" pairs %8ld / %ld (%6.2f%%) | user %4ld / %4ld\r", progress.load(),
-         num_pairs, 0.0, global_pos.load() - nthreads, ranking.size());
+  auto last_publish = get_time();
 
   // UI loop, print the progress in one line using `\r` for going back to the
   // start of the line
-  while (progress < num_pairs) {
-    if (progress) {
+  while (!loaded || progress < num_pairs) {
+    if (!loaded && ready.count() == files.size()) {
+      finish_loading();
+      size_t tot = 0;
+      for (size_t j = 0; j < files.size(); j++) {
+        if (j >= resume_index)
+          num_pairs += files[j].size() * tot;
+        tot += files[j].size();
+      }
+      loaded = true;
+      continue;
+    }
+    if (!loaded) {
+      printf("\033[J pairs %8ld | loaded %6ld files | user %4ld / %4ld ready "
+             "| cur",
+             progress.load(), num_files.load(), ready.count(), ranking.size());
+      for (auto index : current_index)
+        printf(" %ld", index);
+      printf("\r");
+      fflush(stdout);
+    } else if (progress) {
       auto [h, m, s] = compute_eta(start, progress.load(), num_pairs);
       printf("\033[J pairs %8ld / %ld (%6.2f%%) | user %4ld / %4ld | ETA "
              "%4d:%02d:%02d | cur",
@@ -258,6 +338,11 @@ int main(int argc, char **argv) {
       printf("\r");
       fflush(stdout);
     }
+    auto now = get_time();
+    if (now - last_publish > PUBLISH_INTERVAL) {
+      last_publish = now;
+      publish_provisional(target_path, partial_hi, partial_lo);
+    }
     using namespace std::chrono_literals;
     std::this_thread::sleep_for(1s);
   }
@@ -271,13 +356,15 @@ int main(int argc, char **argv) {
   }
 
   // merge the partial results of each thread with the previous partial results
-  for (auto &[hi, lo] : results) {
-    partial_hi.insert(hi.begin(), hi.end());
-    partial_lo.insert(lo.begin(), lo.end());
+  for (int i = 0; i < nthreads; i++) {
+    partial_hi.insert(top_hi.heap(i).begin(), top_hi.heap(i).end());
+    partial_lo.insert(top_lo.heap(i).begin(), top_lo.heap(i).end());
   }
   prune_extra_results(partial_hi);
   prune_extra_results(partial_lo);
   save_snap(global_pos.load(), partial_hi, partial_lo,
             target_path + "/partial");
   save_snap(global_pos.load(), partial_hi, partial_lo, target_path + "/total");
+  save_binary(global_pos.load(), partial_hi, partial_lo,
+              target_path + "/total.bin");
 }
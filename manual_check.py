@@ -3,16 +3,41 @@
 import argparse
 import subprocess
 import os
+import struct
 
+BINARY_MAGIC = b"STARPLG1"
 
-def main(args):
-    hi = []
-    lo = []
-    with open(args.results) as f:
+
+def read_binary(path):
+    # see save_binary in snapshot.hpp for the format
+    with open(path, "rb") as f:
+        data = f.read()
+    pos = len(BINARY_MAGIC)
+    _, num_paths = struct.unpack_from("<QI", data, pos)
+    pos += 12
+    paths = []
+    for _ in range(num_paths):
+        length, = struct.unpack_from("<I", data, pos)
+        paths.append(data[pos + 4:pos + 4 + length].decode())
+        pos += 4 + length
+    len1, len2 = struct.unpack_from("<II", data, pos)
+    pos += 8
+    records = struct.iter_unpack("<fII", data[pos:pos + 12 * (len1 + len2)])
+    results = [(perc, paths[f1], paths[f2]) for perc, f1, f2 in records]
+    return results[:len1], results[len1:]
+
+
+def read_text(path):
+    with open(path) as f:
         _, len1, _ = map(int, f.readline().split())
         rest = f.read().splitlines()
-        hi = [l.split() for l in rest[:len1]]
-        lo = [l.split() for l in rest[len1:]]
+        return [l.split() for l in rest[:len1]], [l.split() for l in rest[len1:]]
+
+
+def main(args):
+    with open(args.results, "rb") as f:
+        binary = f.read(len(BINARY_MAGIC)) == BINARY_MAGIC
+    hi, lo = read_binary(args.results) if binary else read_text(args.results)
 
     done = {}
     if os.path.exists(args.cache):
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <vector>
+
+// Queue between two stages of the pipeline: the producer blocks while the
+// queue is full, so a fast stage cannot run too far ahead of the next one.
+template <typename T> class bounded_queue_t {
+public:
+  bounded_queue_t(size_t capacity) : capacity(capacity) {}
+
+  void push(T item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_full.wait(lock, [this]() { return items.size() < capacity; });
+    items.push(std::move(item));
+    not_empty.notify_one();
+  }
+
+  // Returns false when the queue is closed and there are no items left.
+  bool pop(T &item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_empty.wait(lock, [this]() { return !items.empty() || closed; });
+    if (items.empty())
+      return false;
+    item = std::move(items.front());
+    items.pop();
+    not_full.notify_one();
+    return true;
+  }
+
+  // No more items will be pushed.
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    not_empty.notify_all();
+  }
+
+private:
+  size_t capacity;
+  bool closed = false;
+  std::queue<T> items;
+  std::mutex mutex;
+  std::condition_variable not_empty, not_full;
+};
+
+// Tracks which users have all their files loaded and compared with the
+// templates. The users may become ready out of order, but the comparisons
+// against user `u` need all the users before it.
+class ready_users_t {
+public:
+  ready_users_t(size_t num_users) : ready(num_users) {}
+
+  void mark(size_t u) {
+    std::lock_guard<std::mutex> lock(mutex);
+    ready[u] = true;
+    while (prefix < ready.size() && ready[prefix])
+      prefix++;
+    changed.notify_all();
+  }
+
+  // Wait until the users [0, u] are all ready.
+  void wait(size_t u) {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this, u]() { return prefix > u; });
+  }
+
+  // Number of users at the start of the ranking that are ready.
+  size_t count() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return prefix;
+  }
+
+private:
+  std::vector<bool> ready;
+  size_t prefix = 0;
+  std::mutex mutex;
+  std::condition_variable changed;
+};
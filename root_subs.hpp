@@ -1,52 +1,104 @@
 #pragma once
 
 #include "file.hpp"
+#include "workspace.hpp"
 #include <algorithm>
+#include <cassert>
+#include <cstdint>
 #include <cstring>
 #include <tuple>
 #include <vector>
 
-using subs_t = std::vector<std::vector<key_t>>;
+// Data of a file that does not depend on the file it is compared with, to be
+// computed once when the file is compared with many others.
+struct query_profile_t {
+  const file_t *file;
+  // whether each token can be substituted (i.e. it is not a symbol)
+  std::vector<uint8_t> word;
+  // one more than the largest key in the file
+  key_t vocab_size;
 
-struct root_subs_t {
-  subs_t subs;
-  size_t add_del_dist;
-  size_t space_dist;
-  diffs_t diff1;
-  diffs_t diff2;
-  diffs_t wdiff1;
-  diffs_t wdiff2;
+  query_profile_t(const file_t &file) : file(&file), vocab_size(1) {
+    word.reserve(file.content.size());
+    for (key_t k : file.content) {
+      word.push_back(k >= 0);
+      vocab_size = std::max(vocab_size, k + 1);
+    }
+  }
 };
 
 // Try to transform file1 into file2 by removing tokens or by substituing
-// tokens. It returns the substitutions of each token.
-root_subs_t root_subs(const file_t &file1, const file_t &file2) {
+// tokens. It returns the substitutions of each token, stored in the workspace
+// and valid until its next use. If `shared_rows` is not zero, the workspace
+// was last used with the same query and a file1 starting with the same
+// `shared_rows` tokens, and at least as many rows of the DP were computed.
+const root_subs_t &root_subs(const file_t &file1, const query_profile_t &query,
+                             workspace_t &ws, size_t shared_rows = 0) {
+  const file_t &file2 = *query.file;
+  std::vector<uint32_t> &DP = ws.DP;
   size_t len1 = file1.content.size();
   size_t len2 = file2.content.size();
-  std::vector<std::vector<size_t>> DP(len2 + 1, std::vector<size_t>(len1 + 1));
-  for (size_t i = 0; i <= len1; i++)
-    DP[0][i] = i;
+  // a wrong number of shared rows would silently give a wrong score
+  assert(shared_rows == 0 ||
+         (ws.dp_query == query.file && shared_rows <= ws.dp_rows &&
+          shared_rows <= len1 &&
+          std::equal(file1.content.begin(),
+                     file1.content.begin() + shared_rows,
+                     ws.dp_file->content.begin())));
+  // the traceback walks the common suffix without looking at the DP, so its
+  // rows are not needed
+  size_t suffix = 0;
+  while (ws.skip_shared && suffix < std::min(len1, len2) &&
+         file1[len1 - 1 - suffix] == file2[len2 - 1 - suffix])
+    suffix++;
+  size_t rows = len1 - suffix;
+  // DP[i1][i2] is the distance between the first i1 tokens of file1 and the
+  // first i2 tokens of file2, the rows are contiguous in the buffer
+  size_t width = len2 + 1;
+  if (DP.size() < (rows + 1) * width)
+    DP.resize((rows + 1) * width);
+  auto dp = [&DP, width](size_t i2, size_t i1) -> uint32_t & {
+    return DP[i1 * width + i2];
+  };
+  for (size_t i = 0; i <= len2; i++)
+    dp(i, 0) = i;
 
-  for (size_t i = 1; i <= len2; i++) {
-    for (size_t j = 0; j <= len1; j++) {
-      if (j == 0)
-        DP[i][j] = i;
-      else if (file1[j - 1] == file2[i - 1]) {
-        DP[i][j] = DP[i - 1][j - 1];
-      } else {
-        DP[i][j] = 1 + std::min(DP[i - 1][j], DP[i][j - 1]);
-        if (file1[j - 1] >= 0 && file2[i - 1] >= 0)
-          DP[i][j] = std::min(DP[i][j], 1 + DP[i - 1][j - 1]);
-      }
+  const key_t *q = file2.content.data();
+  const uint8_t *word = query.word.data();
+  // each row only depends on the tokens of file1 before it
+  for (size_t j = shared_rows + 1; j <= rows; j++) {
+    const uint32_t *prev = &dp(0, j - 1);
+    uint32_t *cur = &dp(0, j);
+    key_t t = file1[j - 1];
+    uint8_t t_word = t >= 0;
+    cur[0] = j;
+    // without the dependency on the left cell this loop is vectorized
+    for (size_t i = 1; i <= len2; i++) {
+      uint32_t diag = prev[i - 1], up = prev[i];
+      uint32_t best = (t_word & word[i - 1]) ? std::min(up, diag) : up;
+      cur[i] = q[i - 1] == t ? diag : best + 1;
     }
+    // the left cell is never better than the diagonal on equal tokens, since
+    // adjacent cells differ by at most one
+    for (size_t i = 1; i <= len2; i++)
+      cur[i] = std::min(cur[i], cur[i - 1] + 1);
   }
+  ws.dp_rows = rows;
+  ws.dp_file = &file1;
+  ws.dp_query = query.file;
 
   size_t i1 = len1;
   size_t i2 = len2;
   size_t add_del_dist = 0;
-  std::vector<key_t> s1, s2;
-  std::vector<int> si1, si2;
-  diffs_t diff1, diff2;
+  auto &s1 = ws.s1, &s2 = ws.s2;
+  auto &si1 = ws.si1, &si2 = ws.si2;
+  auto &diff1 = ws.result.diff1, &diff2 = ws.result.diff2;
+  s1.clear();
+  s2.clear();
+  si1.clear();
+  si2.clear();
+  diff1.clear();
+  diff2.clear();
   while (i1 > 0 && i2 > 0) {
     if (file1[i1 - 1] == file2[i2 - 1]) {
       // same char
@@ -61,7 +113,7 @@ root_subs_t root_subs(const file_t &file1, const file_t &file2) {
       si2.push_back(i2);
       diff1.push_back(diff_t::SAME);
       diff2.push_back(diff_t::SAME);
-    } else if (DP[i2][i1] == DP[i2 - 1][i1 - 1] + 1 && file1[i1 - 1] >= 0 &&
+    } else if (dp(i2, i1) == dp(i2 - 1, i1 - 1) + 1 && file1[i1 - 1] >= 0 &&
                file2[i2 - 1] >= 0) {
       // subst token (not symbol)
       s1.push_back(file1[--i1]);
@@ -72,7 +124,7 @@ root_subs_t root_subs(const file_t &file1, const file_t &file2) {
       diff2.push_back(diff_t::CHANGED);
     } else {
       // add/delete
-      if (DP[i2][i1] == DP[i2 - 1][i1] + 1) {
+      if (dp(i2, i1) == dp(i2 - 1, i1) + 1) {
         --i2;
         diff2.push_back(diff_t::ADDED);
       } else {
@@ -100,18 +152,42 @@ root_subs_t root_subs(const file_t &file1, const file_t &file2) {
   si1.push_back(len1);
   si2.push_back(len2);
 
-  subs_t subs(rev_mapping.size());
+  // only the tokens of these files can have substitutions, and reading the
+  // size of rev_mapping would race with the files still being loaded
+  key_t vocab_size = query.vocab_size;
+  for (key_t k : file1.content)
+    vocab_size = std::max(vocab_size, k + 1);
+  if (ws.count.size() < (size_t)vocab_size) {
+    ws.count.resize(vocab_size);
+    ws.next.resize(vocab_size);
+  }
 
-  for (size_t i = 0; i < rev_mapping.size(); i++) {
-    subs[i].push_back(i);
+  // group the substitutions by token, keeping them in order
+  subs_t &subs = ws.result.subs;
+  ws.touched.clear();
+  for (key_t k : s1) {
+    if (ws.count[k]++ == 0)
+      ws.touched.push_back(k);
+  }
+  subs.vocab_size = vocab_size;
+  subs.values.resize(s1.size() + ws.touched.size());
+  subs.offsets.resize(1);
+  for (key_t k : ws.touched) {
+    size_t begin = subs.offsets.back();
+    subs.values[begin] = k;
+    ws.next[k] = begin + 1;
+    subs.offsets.push_back(begin + 1 + ws.count[k]);
+    ws.count[k] = 0;
   }
   for (size_t i = 0; i < s1.size(); i++) {
-    subs[s1[i]].push_back(s2[i]);
+    subs.values[ws.next[s1[i]]++] = s2[i];
   }
 
-  size_t space_dist = len1 + len2 + 2;
-  diffs_t wdiff1(file1.spaces.size(), diff_t::ADDED);
-  diffs_t wdiff2(file2.spaces.size(), diff_t::ADDED);
+  size_t &space_dist = ws.result.space_dist;
+  auto &wdiff1 = ws.result.wdiff1, &wdiff2 = ws.result.wdiff2;
+  space_dist = len1 + len2 + 2;
+  wdiff1.assign(file1.spaces.size(), diff_t::ADDED);
+  wdiff2.assign(file2.spaces.size(), diff_t::ADDED);
   for (size_t i = 0; i < si1.size() - 1; i++) {
     if (si1[i] + 1 == si1[i + 1] && si2[i] + 1 == si2[i + 1]) {
       if (file1.spaces[si1[i + 1]] == file2.spaces[si2[i + 1]]) {
@@ -125,14 +201,20 @@ root_subs_t root_subs(const file_t &file1, const file_t &file2) {
     }
   }
 
-  return {subs, add_del_dist, space_dist, diff1, diff2, wdiff1, wdiff2};
+  ws.result.add_del_dist = add_del_dist;
+  return ws.result;
+}
+
+root_subs_t root_subs(const file_t &file1, const file_t &file2) {
+  workspace_t ws;
+  return root_subs(file1, query_profile_t(file2), ws);
 }
 
 int edit_dist(const file_t &file1, const file_t &file2) {
   auto [subs, dist, _1, _2, _3, _4, _5] = root_subs(file1, file2);
-  for (key_t i = 0; i < (key_t)subs.size(); i++) {
-    for (key_t &k : subs[i]) {
-      dist += (k != i);
+  for (size_t i = 0; i < subs.size(); i++) {
+    for (size_t j = 1; j < subs.length(i); j++) {
+      dist += (subs[i][j] != subs[i][0]);
     }
   }
   return dist;
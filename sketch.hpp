@@ -0,0 +1,82 @@
+#pragma once
+
+#include "file.hpp"
+#include "smart_dist.hpp"
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <limits>
+
+const size_t SKETCH_SIZE = 128;
+const size_t SHINGLE_LEN = 4;
+const uint32_t EMPTY_BIN = std::numeric_limits<uint32_t>::max();
+
+using sketch_t = std::array<uint32_t, SKETCH_SIZE>;
+
+// MinHash sketches of the token shingles of a file, without and with the
+// whitespace folded in. They are only needed in approximate mode, so they are
+// kept apart from file_t.
+struct file_sketch_t {
+  sketch_t tokens;
+  sketch_t spaces;
+};
+
+uint64_t mix_hash(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+// One permutation MinHash: each shingle falls in a single bin, which keeps the
+// minimum hash value seen.
+void sketch_shingles(const std::vector<uint64_t> &keys, sketch_t &sketch) {
+  sketch.fill(EMPTY_BIN);
+  size_t num_shingles = keys.size() >= SHINGLE_LEN
+                            ? keys.size() - SHINGLE_LEN + 1
+                            : (keys.empty() ? 0 : 1);
+  for (size_t i = 0; i < num_shingles; i++) {
+    uint64_t h = 0;
+    for (size_t k = i; k < std::min(i + SHINGLE_LEN, keys.size()); k++)
+      h = mix_hash(h ^ keys[k]);
+    uint32_t &bin = sketch[(h >> 32) % SKETCH_SIZE];
+    // EMPTY_BIN is never stored as a value
+    bin = std::min(bin, std::min<uint32_t>(h, EMPTY_BIN - 1));
+  }
+}
+
+file_sketch_t compute_sketch(const file_t &file) {
+  file_sketch_t sketch;
+  std::vector<uint64_t> keys(file.content.size());
+  for (size_t i = 0; i < file.content.size(); i++)
+    keys[i] = (uint32_t)file.content[i];
+  sketch_shingles(keys, sketch.tokens);
+  // fold the whitespace before each token in its id
+  for (size_t i = 0; i < file.content.size(); i++)
+    keys[i] = mix_hash(keys[i] ^ std::hash<std::string>()(file.spaces[i]));
+  sketch_shingles(keys, sketch.spaces);
+  return sketch;
+}
+
+// Estimated Jaccard similarity, in percentage, of the two sets of shingles.
+// Written without branches so that the compiler vectorizes it.
+float sketch_similarity(const sketch_t &a, const sketch_t &b) {
+  uint32_t same = 0, used = 0;
+  for (size_t k = 0; k < SKETCH_SIZE; k++) {
+    same += (a[k] == b[k]) & (a[k] != EMPTY_BIN);
+    used += (a[k] != EMPTY_BIN) | (b[k] != EMPTY_BIN);
+  }
+  return used ? 100.0 * same / used : 100.0;
+}
+
+// Cheap estimate of smart_dist, using the sketches of the files.
+float sketch_dist(const file_t &file1, const file_sketch_t &sketch1,
+                  const file_t &file2, const file_sketch_t &sketch2,
+                  float space_weight = 0.3) {
+  if (!comparable(file1, file2)) {
+    return 0;
+  }
+  return sketch_similarity(sketch1.tokens, sketch2.tokens) *
+             (1 - space_weight) +
+         sketch_similarity(sketch1.spaces, sketch2.spaces) * space_weight;
+}
@@ -2,21 +2,102 @@
 
 #include "root_subs.hpp"
 #include "subs_dist.hpp"
+#include <algorithm>
 
 bool is_template(const file_t &file) {
   return file.path.find("template") != std::string::npos;
 }
 
-float smart_dist(const file_t &file1, const file_t &file2, float space_weight = 0.3) {
-  if (file1.group != file2.group && !is_template(file1) && !is_template(file2)) {
+// Only the files of the same group, or the templates, are compared.
+bool comparable(const file_t &file1, const file_t &file2) {
+  return file1.group == file2.group || is_template(file1) || is_template(file2);
+}
+
+float smart_dist(const file_t &file1, const query_profile_t &query,
+                 workspace_t &ws, float space_weight = 0.3,
+                 size_t shared_rows = 0) {
+  const file_t &file2 = *query.file;
+  if (!comparable(file1, file2)) {
     return 0;
   }
-  auto [subs, add_del_dist, space_dist, _1, _2, _3, _4] =
-      root_subs(file1, file2);
-  int token_dist = add_del_dist + subs_dist(subs);
+  const root_subs_t &rs = root_subs(file1, query, ws, shared_rows);
+  int token_dist = rs.add_del_dist + subs_dist(rs.subs, ws);
   float token_perc =
       100 - 100.0 * token_dist / (file1.content.size() + file2.content.size());
   float space_perc =
-      100 - 100.0 * space_dist / (file1.spaces.size() + file2.spaces.size());
+      100 - 100.0 * rs.space_dist / (file1.spaces.size() + file2.spaces.size());
   return token_perc * (1 - space_weight) + space_perc * space_weight;
 }
+
+float smart_dist(const file_t &file1, const file_t &file2, float space_weight = 0.3) {
+  workspace_t ws;
+  return smart_dist(file1, query_profile_t(file2), ws, space_weight);
+}
+
+// Sort the targets in lexicographic order of their tokens, so that the ones
+// with a common prefix (e.g. submissions of the same user, or solutions written
+// on the same template) are next to each other.
+void prepare_block(const user_files_t &targets, block_t &block) {
+  block.targets = &targets;
+  block.order.resize(targets.size());
+  for (size_t k = 0; k < targets.size(); k++)
+    block.order[k] = k;
+  std::sort(block.order.begin(), block.order.end(),
+            [&targets](size_t a, size_t b) {
+              const auto &content_a = targets[a].first.content;
+              const auto &content_b = targets[b].first.content;
+              return content_a != content_b ? content_a < content_b : a < b;
+            });
+  block.lcp.assign(targets.size(), 0);
+  block.same.assign(targets.size(), false);
+  for (size_t k = 1; k < targets.size(); k++) {
+    const file_t &prev = targets[block.order[k - 1]].first;
+    const file_t &cur = targets[block.order[k]].first;
+    size_t len = std::min(prev.content.size(), cur.content.size());
+    while (block.lcp[k] < len &&
+           prev.content[block.lcp[k]] == cur.content[block.lcp[k]])
+      block.lcp[k]++;
+    block.same[k] = prev.content == cur.content && prev.spaces == cur.spaces;
+  }
+}
+
+// Compare a block of files with the same query, reusing its profile and the
+// workspace: smart_dist(targets[k].first, *query.file) is appended to scores.
+// Consecutive targets in the order of the block share the DP rows of their
+// common prefix, and identical targets are compared only once.
+void smart_dist_many(const query_profile_t &query, const block_t &block,
+                     workspace_t &ws, std::vector<float> &scores,
+                     float space_weight = 0.3) {
+  const user_files_t &targets = *block.targets;
+  size_t base = scores.size();
+  scores.resize(base + targets.size());
+
+  // the last target compared, whose DP rows are in the workspace, and the
+  // common prefix and identity of the targets since then: in sorted order the
+  // common prefix of two targets is the minimum of the ones between them
+  bool has_prev = false;
+  size_t prev_k = 0;
+  size_t lcp = 0;
+  bool same = true;
+  for (size_t pos = 0; pos < targets.size(); pos++) {
+    size_t k = block.order[pos];
+    const file_t &target = targets[k].first;
+    lcp = std::min(lcp, block.lcp[pos]);
+    same = same && block.same[pos];
+    if (!comparable(target, *query.file)) {
+      scores[base + k] = 0;
+      continue;
+    }
+    if (has_prev && ws.skip_shared && same) {
+      scores[base + k] = scores[base + prev_k];
+      continue;
+    }
+    size_t shared_rows =
+        has_prev && ws.skip_shared ? std::min(lcp, ws.dp_rows) : 0;
+    scores[base + k] = smart_dist(target, query, ws, space_weight, shared_rows);
+    has_prev = true;
+    prev_k = k;
+    lcp = target.content.size();
+    same = true;
+  }
+}
@@ -1,13 +1,19 @@
 #pragma once
 
+#include "file.hpp"
+#include <cstdint>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
+#include <map>
 #include <set>
 #include <string>
+#include <type_traits>
 
 const size_t MAX_RESULTS = 500;
+const char BINARY_MAGIC[8] = {'S', 'T', 'A', 'R', 'P', 'L', 'G', '1'};
 
-using info_t = std::tuple<float, std::string, std::string>;
+using info_t = std::tuple<float, file_id_t, file_id_t>;
 using partial_t = std::set<info_t, std::greater<info_t>>;
 
 template <typename T>
@@ -16,14 +22,65 @@ void save_snap(size_t index, const T &hi, const T &lo, std::string path) {
   std::ofstream snap(temp_snap);
   snap << index << " " << hi.size() << " " << lo.size() << std::endl;
   for (const auto &[a, b, c] : hi) {
-    snap << a << " " << b << " " << c << std::endl;
+    snap << a << " " << get_file_path(b) << " " << get_file_path(c)
+         << std::endl;
   }
   for (const auto &[a, b, c] : lo) {
-    snap << a << " " << b << " " << c << std::endl;
+    snap << a << " " << get_file_path(b) << " " << get_file_path(c)
+         << std::endl;
   }
   std::filesystem::rename(temp_snap, path);
 }
 
+// Same content of save_snap in binary: the magic, the index, the table of the
+// paths used by the results, the number of results of the two tiers and then
+// the results as (score, path id, path id). The numbers are little endian, 64
+// bits for the index and 32 bits for the rest, and each path is preceded by its
+// length.
+void save_binary(size_t index, const partial_t &hi, const partial_t &lo,
+                 std::string path) {
+  std::map<file_id_t, uint32_t> table;
+  std::vector<file_id_t> ids;
+  for (const auto *part : {&hi, &lo}) {
+    for (const auto &[a, b, c] : *part) {
+      for (file_id_t id : {b, c}) {
+        if (table.emplace(id, ids.size()).second)
+          ids.push_back(id);
+      }
+    }
+  }
+
+  std::string temp_snap = path + "_temp";
+  std::ofstream out(temp_snap, std::ios::binary);
+  // write the integer, or the bits of the float, as little endian
+  auto write = [&out](auto value) {
+    std::conditional_t<sizeof(value) == 8, uint64_t, uint32_t> bits;
+    static_assert(sizeof(bits) == sizeof(value));
+    std::memcpy(&bits, &value, sizeof(value));
+    for (size_t i = 0; i < sizeof(value); i++)
+      out.put((char)(bits >> (8 * i)));
+  };
+  out.write(BINARY_MAGIC, sizeof(BINARY_MAGIC));
+  write((uint64_t)index);
+  write((uint32_t)ids.size());
+  for (file_id_t id : ids) {
+    std::string file_path = get_file_path(id);
+    write((uint32_t)file_path.size());
+    out.write(file_path.data(), file_path.size());
+  }
+  write((uint32_t)hi.size());
+  write((uint32_t)lo.size());
+  for (const auto *part : {&hi, &lo}) {
+    for (const auto &[a, b, c] : *part) {
+      write(a);
+      write(table[b]);
+      write(table[c]);
+    }
+  }
+  out.close();
+  std::filesystem::rename(temp_snap, path);
+}
+
 void read_snap(const std::string &path, bool partial, size_t &resume_index,
                partial_t &partial_hi, partial_t &partial_lo) {
   float perc;
@@ -37,11 +94,11 @@ void read_snap(const std::string &path, bool partial, size_t &resume_index,
   in >> num_hi >> num_lo;
   for (size_t i = 0; i < num_hi; i++) {
     in >> perc >> a >> b;
-    partial_hi.emplace(perc, a, b);
+    partial_hi.emplace(perc, get_file_id(a), get_file_id(b));
   }
   for (size_t i = 0; i < num_lo; i++) {
     in >> perc >> a >> b;
-    partial_lo.emplace(perc, a, b);
+    partial_lo.emplace(perc, get_file_id(a), get_file_id(b));
   }
 };
 
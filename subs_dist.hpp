@@ -2,46 +2,66 @@
 
 #include "root_subs.hpp"
 
-int local_dist(const subs_t::value_type &v, size_t l, size_t r,
-               const std::vector<int> &pointers, size_t base,
-               std::map<std::tuple<size_t, size_t, size_t>, int> &dp) {
+uint64_t memo_key(size_t l, size_t r, size_t base) {
+  // the lists of substitutions are shorter than the files
+  return ((uint64_t)l << 42) | ((uint64_t)r << 21) | base;
+}
+
+int local_dist(const key_t *v, size_t l, size_t r,
+               const std::vector<int> &pointers, size_t base, memo_t &dp) {
   if (l == r)
     return 0;
 
-  if (dp.count({l, r, base}))
-    return dp[{l, r, base}];
+  uint64_t key = memo_key(l, r, base);
+  if (const int *res = dp.find(key))
+    return *res;
 
-  auto &ref = dp[{l, r, base}];
-  if (v[l] == v[base])
-    return ref = local_dist(v, l + 1, r, pointers, l, dp);
-  if (v[r - 1] == v[base])
-    return ref = local_dist(v, l, r - 1, pointers, base, dp);
+  int res;
+  if (v[l] == v[base]) {
+    res = local_dist(v, l + 1, r, pointers, l, dp);
+  } else if (v[r - 1] == v[base]) {
+    res = local_dist(v, l, r - 1, pointers, base, dp);
+  } else {
+    // overwrite base
+    res = 1 + local_dist(v, l + 1, r, pointers, l, dp);
 
-  // overwrite base
-  ref = 1 + local_dist(v, l + 1, r, pointers, l, dp);
-
-  // use base with split
-  for (size_t split = pointers[base]; split < r; split = pointers[split]) {
-    ref = std::min(ref, local_dist(v, l, split, pointers, base, dp) +
-                            local_dist(v, split + 1, r, pointers, split, dp));
+    // use base with split
+    for (size_t split = pointers[base]; split < r; split = pointers[split]) {
+      res = std::min(res, local_dist(v, l, split, pointers, base, dp) +
+                              local_dist(v, split + 1, r, pointers, split, dp));
+    }
   }
 
-  return ref;
+  // the table may have grown during the recursion, so the result is stored
+  // only now
+  dp.insert(key, res);
+  return res;
 }
 
-int subs_dist(const subs_t &subs) {
+int subs_dist(const subs_t &subs, workspace_t &ws) {
+  if (ws.last.size() < (size_t)subs.vocab_size)
+    ws.last.resize(subs.vocab_size, -1);
   int dist = 0;
-  for (key_t i = 0; i < (key_t)subs.size(); i++) {
-    std::map<std::tuple<size_t, size_t, size_t>, int> dp;
-    std::vector<int> pointers(subs[i].size());
-    std::vector<int> last(rev_mapping.size(), subs[i].size());
-    for (int j = subs[i].size() - 1; j >= 0; --j) {
-      pointers[j] = last[subs[i][j]];
-      last[subs[i][j]] = j;
+  for (size_t i = 0; i < subs.size(); i++) {
+    const key_t *v = subs[i];
+    int len = subs.length(i);
+    ws.memo.clear();
+    ws.pointers.resize(len);
+    // pointers[j] is the next position with the same token of j, or len
+    for (int j = len - 1; j >= 0; --j) {
+      ws.pointers[j] = ws.last[v[j]] < 0 ? len : ws.last[v[j]];
+      ws.last[v[j]] = j;
     }
+    for (int j = 0; j < len; j++)
+      ws.last[v[j]] = -1;
 
-    // note that subs[i][0] = i
-    dist += local_dist(subs[i], 1, subs[i].size(), pointers, 0, dp);
+    // note that v[0] is the token itself
+    dist += local_dist(v, 1, len, ws.pointers, 0, ws.memo);
   }
   return dist;
 }
+
+int subs_dist(const subs_t &subs) {
+  workspace_t ws;
+  return subs_dist(subs, ws);
+}
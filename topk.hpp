@@ -0,0 +1,55 @@
+#pragma once
+
+#include "snapshot.hpp"
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <limits>
+#include <vector>
+
+using queue_t = std::vector<info_t>;
+
+// Best MAX_RESULTS results of a tier, kept in a min-heap for each worker so
+// that pushing never waits for the other threads. Every heap is a subset of all
+// the results, so the largest of the minimums of the full heaps is a lower
+// bound of the global MAX_RESULTS-th score: it is published to all the workers
+// as the admission floor and the results below it are discarded immediately.
+class shared_topk_t {
+public:
+  shared_topk_t(size_t num_workers) : heaps(num_workers) {}
+
+  float floor() const {
+    return admission_floor.load(std::memory_order_relaxed);
+  }
+
+  // Only worker `wid` can push in its heap.
+  void push(size_t wid, const info_t &info) {
+    queue_t &pq = heaps[wid];
+    if (std::get<0>(info) < floor() ||
+        (pq.size() == MAX_RESULTS && info <= pq.front()))
+      return;
+    pq.push_back(info);
+    std::push_heap(pq.begin(), pq.end(), std::greater<info_t>());
+    if (pq.size() > MAX_RESULTS) {
+      std::pop_heap(pq.begin(), pq.end(), std::greater<info_t>());
+      pq.pop_back();
+    }
+    if (pq.size() == MAX_RESULTS)
+      raise_floor(std::get<0>(pq.front()));
+  }
+
+  // There are already MAX_RESULTS results with at least this score.
+  void raise_floor(float score) {
+    float current = floor();
+    while (current < score &&
+           !admission_floor.compare_exchange_weak(current, score,
+                                                  std::memory_order_relaxed))
+      ;
+  }
+
+  const queue_t &heap(size_t wid) const { return heaps[wid]; }
+
+private:
+  std::vector<queue_t> heaps;
+  std::atomic<float> admission_floor{std::numeric_limits<float>::lowest()};
+};
@@ -1,15 +1,18 @@
 #pragma once
 
 #include "file.hpp"
+#include "pipeline.hpp"
 #include "smart_dist.hpp"
 #include "snapshot.hpp"
+#include "topk.hpp"
 #include <atomic>
 #include <chrono>
 #include <queue>
 #include <vector>
 
-using queue_t = std::vector<info_t>;
-using file_list_t = std::vector<std::vector<std::pair<file_t, float>>>;
+using file_list_t = std::vector<user_files_t>;
+// blocks[u] is the block of files[u], prepared once when the user is ready
+using block_list_t = std::vector<block_t>;
 
 const double SNAP_INTERVAL = 0;
 
@@ -20,16 +23,70 @@ double get_time() {
          1.0e9;
 }
 
-void worker(file_list_t *files_ptr, size_t cutoff,
-            std::atomic<size_t> *global_pos, int wid,
-            std::pair<queue_t, queue_t> *result, std::atomic<size_t> *progress,
-            size_t *current_index, std::string targetdir) {
-  queue_t &hi = result->first;
-  queue_t &lo = result->second;
+using profiles_t = std::vector<query_profile_t>;
+
+profiles_t make_profiles(const user_files_t &user_files) {
+  profiles_t profiles;
+  for (const auto &[file, perc] : user_files) {
+    profiles.emplace_back(file);
+  }
+  return profiles;
+}
+
+// Find the most similar pair of files of the users i and j, the score is
+// negative if there are none. `profiles` are the ones of the files of j, each
+// of them is compared with all the files of i in a single batch.
+info_t best_match(const file_list_t &files, const block_list_t &blocks,
+                  size_t i, size_t j, const profiles_t &profiles,
+                  workspace_t &ws) {
+  // scores[b * files[i].size() + a] is the score of the a-th file of i and the
+  // b-th file of j
+  std::vector<float> &scores = ws.scores;
+  scores.clear();
+  for (const auto &query : profiles) {
+    smart_dist_many(query, blocks[i], ws, scores);
+  }
+
+  info_t best = {-1, 0, 0};
+  for (size_t a = 0; a < files[i].size(); a++) {
+    const auto &[f1, p1] = files[i][a];
+    for (size_t b = 0; b < files[j].size(); b++) {
+      const auto &[f2, p2] = files[j][b];
+      float perc = scores[b * files[i].size() + a];
+      // the solutions are more similar to a template than they are between
+      // each other
+      if (perc < p1 || perc < p2) {
+        continue;
+      }
+      if (perc > std::get<0>(best)) {
+        best = {perc, f1.id, f2.id};
+      }
+    }
+  }
+  return best;
+}
+
+info_t best_match(const file_list_t &files, const block_list_t &blocks,
+                  size_t i, size_t j, workspace_t &ws) {
+  return best_match(files, blocks, i, j, make_profiles(files[j]), ws);
+}
+
+// Compare the files of each user with the files of all the users before it in
+// the ranking. The users are processed in ranking order, so `index` in the
+// snapshots means that all the pairs before that user are done.
+void worker(file_list_t *files_ptr, block_list_t *blocks_ptr, size_t cutoff,
+            std::atomic<size_t> *global_pos, int wid, shared_topk_t *top_hi,
+            shared_topk_t *top_lo, std::atomic<size_t> *progress,
+            size_t *current_index, ready_users_t *ready,
+            std::string targetdir) {
+  const queue_t &hi = top_hi->heap(wid);
+  const queue_t &lo = top_lo->heap(wid);
   const file_list_t &files = *files_ptr;
+  const block_list_t &blocks = *blocks_ptr;
 
   auto last_snap = get_time();
   size_t &index = *current_index;
+  workspace_t ws;
 
   for (index = (*global_pos)++; index < files.size(); index = (*global_pos)++) {
     auto now = get_time();
@@ -37,33 +94,16 @@ void worker(file_list_t *files_ptr, size_t cutoff,
       last_snap = now;
       save_snap(index, hi, lo, targetdir + "/snap" + std::to_string(wid));
     }
-    for (size_t j = index + 1; j < files.size(); j++) {
-      info_t best = {-1, "", ""};
-      for (const auto &[f1, p1] : files[index]) {
-        for (const auto &[f2, p2] : files[j]) {
-          float perc = smart_dist(f1, f2);
-          // the solutions are more similar to a template than they are between
-          // each other
-          if (perc < p1 || perc < p2) {
-            continue;
-          }
-          if (perc > std::get<0>(best)) {
-            best = {perc, f1.path, f2.path};
-          }
-        }
-      }
-      *progress += files[index].size() * files[j].size();
+    // the files of this user and of the ones before it must be ready
+    ready->wait(index);
+    profiles_t profiles = make_profiles(files[index]);
+    for (size_t i = 0; i < index; i++) {
+      info_t best = best_match(files, blocks, i, index, profiles, ws);
+      *progress += files[i].size() * files[index].size();
       if (std::get<0>(best) >= 0) {
-        auto &pq = index < cutoff ? hi : lo;
-        pq.push_back(best);
-        std::push_heap(pq.begin(), pq.end(), std::greater<info_t>());
-        if (pq.size() > MAX_RESULTS) {
-          std::pop_heap(pq.begin(), pq.end(), std::greater<info_t>());
-          pq.pop_back();
-        }
+        (i < cutoff ? top_hi : top_lo)->push(wid, best);
       }
     }
   }
-  save_snap(files.size() - 1, hi, lo,
-            targetdir + "/snap" + std::to_string(wid));
+  save_snap(files.size(), hi, lo, targetdir + "/snap" + std::to_string(wid));
 }
@@ -0,0 +1,131 @@
+#pragma once
+
+#include "file.hpp"
+#include <cstdint>
+#include <vector>
+
+// Substitutions of the tokens: for each token aligned at least once, the token
+// itself followed by the tokens it is aligned with, in order.
+struct subs_t {
+  std::vector<key_t> values;
+  // the substitutions of the k-th token are values[offsets[k], offsets[k+1])
+  std::vector<size_t> offsets = {0};
+  // one more than the largest key that can appear in values
+  key_t vocab_size = 1;
+
+  size_t size() const { return offsets.size() - 1; }
+  size_t length(size_t k) const { return offsets[k + 1] - offsets[k]; }
+  const key_t *operator[](size_t k) const { return &values[offsets[k]]; }
+};
+
+struct root_subs_t {
+  subs_t subs;
+  size_t add_del_dist;
+  size_t space_dist;
+  diffs_t diff1;
+  diffs_t diff2;
+  diffs_t wdiff1;
+  diffs_t wdiff2;
+};
+
+// Hash table with the results of local_dist, it can be cleared in constant
+// time by changing the generation of the valid entries.
+class memo_t {
+public:
+  void clear() {
+    if (++generation == 0) {
+      for (auto &entry : table)
+        entry.generation = 0;
+      generation = 1;
+    }
+    used = 0;
+  }
+
+  const int *find(uint64_t key) const {
+    if (table.empty())
+      return nullptr;
+    for (size_t i = slot(key);; i = (i + 1) & (table.size() - 1)) {
+      if (table[i].generation != generation)
+        return nullptr;
+      if (table[i].key == key)
+        return &table[i].value;
+    }
+  }
+
+  void insert(uint64_t key, int value) {
+    if (2 * (used + 1) > table.size())
+      grow();
+    size_t i = slot(key);
+    while (table[i].generation == generation)
+      i = (i + 1) & (table.size() - 1);
+    table[i] = {key, generation, value};
+    used++;
+  }
+
+private:
+  struct entry_t {
+    uint64_t key;
+    uint32_t generation;
+    int value;
+  };
+  std::vector<entry_t> table;
+  size_t used = 0;
+  uint32_t generation = 1;
+  int bits = 0;
+
+  size_t slot(uint64_t key) const {
+    return (key * 0x9e3779b97f4a7c15ULL) >> (64 - bits);
+  }
+
+  void grow() {
+    std::vector<entry_t> old(std::max<size_t>(64, 2 * table.size()));
+    std::swap(old, table);
+    bits = __builtin_ctzll(table.size());
+    uint32_t old_generation = generation;
+    generation = 1;
+    used = 0;
+    for (auto &entry : old)
+      if (entry.generation == old_generation)
+        insert(entry.key, entry.value);
+  }
+};
+
+// Block of files compared with many queries by smart_dist_many. The order in
+// which they are compared only depends on the files, so it is computed once by
+// prepare_block.
+struct block_t {
+  const user_files_t *targets = nullptr;
+  // the targets sorted by their tokens
+  std::vector<size_t> order;
+  // length of the common prefix of the tokens of order[k] and order[k - 1]
+  std::vector<size_t> lcp;
+  // whether order[k] has the same tokens and spaces of order[k - 1]
+  std::vector<uint8_t> same;
+};
+
+// Scratch memory of root_subs and subs_dist. Each thread keeps its own, which
+// grows to the largest pair of files it compares: after that, comparing files
+// does not allocate memory anymore.
+struct workspace_t {
+  // root_subs
+  std::vector<uint32_t> DP;
+  // number of rows of DP computed by the last root_subs, and its files
+  size_t dp_rows = 0;
+  const file_t *dp_file = nullptr;
+  const file_t *dp_query = nullptr;
+  std::vector<key_t> s1, s2;
+  std::vector<int> si1, si2;
+  std::vector<key_t> touched;
+  std::vector<size_t> count, next;
+  root_subs_t result;
+  // subs_dist
+  std::vector<int> pointers, last;
+  memo_t memo;
+  // smart_dist_many
+  std::vector<float> scores;
+  block_t block;
+  // skip the work on the tokens shared by the files: the common suffix, the DP
+  // rows of the common prefix of consecutive targets and the identical
+  // targets. It can be disabled to measure the speedup
+  bool skip_shared = true;
+};